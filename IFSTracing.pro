@@ -13,6 +13,8 @@ SOURCES += \
     main.cpp
 
 DISTFILES += \
+    preview_fs.glsl \
+    splat.glsl \
     trace.glsl \
     trace_fs.glsl \
     trace_vs.glsl
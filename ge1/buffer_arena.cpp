@@ -0,0 +1,80 @@
+#include "buffer_arena.h"
+
+#include <algorithm>
+
+namespace ge1 {
+
+    GLsizeiptr align(GLsizeiptr value, GLsizeiptr alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    buffer_arena::buffer_arena(GLenum usage) :
+        usage(usage), size(0), capacity(0)
+    {}
+
+    void buffer_arena::clear() {
+        size = 0;
+    }
+
+    GLintptr buffer_arena::allocate(GLsizeiptr size, GLsizeiptr alignment) {
+        GLintptr offset = align(this->size, alignment);
+        this->size = offset + size;
+        return offset;
+    }
+
+    bool buffer_arena::reserve() {
+        if (size <= capacity) {
+            return true;
+        }
+        return reallocate(std::max(size, capacity * 2)) || reallocate(size);
+    }
+
+    bool buffer_arena::shrink_to_fit() {
+        if (size < capacity) {
+            return reallocate(size);
+        }
+        return true;
+    }
+
+    GLuint buffer_arena::get_name() const {
+        return name.get_name();
+    }
+
+    GLsizeiptr buffer_arena::get_size() const {
+        return size;
+    }
+
+    GLsizeiptr buffer_arena::get_capacity() const {
+        return capacity;
+    }
+
+    bool buffer_arena::reallocate(GLsizeiptr new_capacity) {
+        if (name.get_name() == 0) {
+            GLuint buffer;
+            glGenBuffers(1, &buffer);
+            name = unique_buffer(buffer);
+        }
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, name.get_name());
+        glBufferData(GL_COPY_WRITE_BUFFER, new_capacity, nullptr, usage);
+
+        /*
+        Errors raised by the caller before the allocation can't be told
+        apart from it and are dropped as well.
+        */
+        bool out_of_memory = false;
+        for (GLenum error; (error = glGetError()) != GL_NO_ERROR;) {
+            out_of_memory = out_of_memory || error == GL_OUT_OF_MEMORY;
+        }
+
+        if (out_of_memory) {
+            // the previous storage can't be relied on either
+            capacity = 0;
+            return false;
+        }
+
+        capacity = new_capacity;
+        return true;
+    }
+
+}
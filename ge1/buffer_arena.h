@@ -0,0 +1,50 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include "vertex_buffer.h"
+
+namespace ge1 {
+
+    // Rounds value up to the next multiple of alignment.
+    GLsizeiptr align(GLsizeiptr value, GLsizeiptr alignment);
+
+    /*
+    Sub-allocates scratch ranges from a single buffer object.
+    The storage only grows when the current ranges don't fit and then
+    at least doubles, so repeated small changes don't reallocate.
+    Contents are not preserved when the storage is reallocated.
+    If growing by double fails, only the exact size is allocated.
+    */
+    struct buffer_arena {
+        buffer_arena(GLenum usage);
+
+        // Discards all ranges but keeps the storage.
+        void clear();
+        // Returns the offset of a new range, aligned to alignment bytes.
+        GLintptr allocate(GLsizeiptr size, GLsizeiptr alignment);
+        /*
+        Makes sure the storage can hold all ranges.
+        Returns false if the storage couldn't be allocated,
+        the previous storage is lost in that case.
+        */
+        bool reserve();
+        /*
+        Reallocates the storage to hold exactly the current ranges.
+        Returns false if the storage couldn't be allocated.
+        */
+        bool shrink_to_fit();
+
+        GLuint get_name() const;
+        GLsizeiptr get_size() const;
+        GLsizeiptr get_capacity() const;
+
+    private:
+        // Returns false if the storage ran out of memory.
+        bool reallocate(GLsizeiptr new_capacity);
+
+        unique_buffer name;
+        GLenum usage;
+        GLsizeiptr size, capacity;
+    };
+}
@@ -1,8 +1,10 @@
 
 SOURCES += \
+    $$PWD/buffer_arena.cpp \
     $$PWD/program.cpp
 
 HEADERS += \
+    $$PWD/buffer_arena.h \
     $$PWD/program.h \
     $$PWD/resources.h \
     $$PWD/span.h \
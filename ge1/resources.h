@@ -73,6 +73,7 @@ namespace ge1 {
         }
         name = other.name;
         other.name = 0;
+        return *this;
     }
 
     template<void (*Deleter)(GLuint)>
@@ -2,10 +2,17 @@
 
 #include <GL/glew.h>
 
+#include "resources.h"
 #include "span.h"
 
 namespace ge1 {
 
+    inline void delete_buffer(GLuint buffer) {
+        glDeleteBuffers(1, &buffer);
+    }
+
+    typedef unique_object<delete_buffer> unique_buffer;
+
     template<class T>
     GLuint create_buffer(GLenum target, GLenum usage, span<T> data) {
         GLuint name;
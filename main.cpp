@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cassert>
 #include <iostream>
 
 #include <GL/glew.h>
@@ -5,6 +7,7 @@
 
 #include <glm/glm.hpp>
 
+#include "ge1/buffer_arena.h"
 #include "ge1/program.h"
 #include "ge1/vertex_buffer.h"
 
@@ -17,46 +20,221 @@ initializer_list<const vec2> quad_positions = {
 };
 
 unsigned window_width, window_height, max_depth, max_queue_depth;
+GLuint trace_program, splat_program, preview_program;
 GLuint view_plane_size_uniform, scanline_stride_uniform, image_stride_uniform;
-GLuint max_depth_uniform, inverse_radius_uniform;
+GLuint max_depth_uniform, max_queue_depth_uniform;
+GLuint inverse_radius_uniform, occlusion_radius_uniform;
+GLuint splat_view_plane_size_uniform, splat_image_size_uniform;
+GLuint splat_scanline_stride_uniform, seed_uniform;
+GLuint points_per_invocation_uniform;
+GLuint preview_scanline_stride_uniform, preview_inverse_radius_uniform;
+
+// The chaos game preview is shown for this many seconds after an edit.
+const double preview_duration = 0.5;
+const unsigned points_per_invocation = 256;
+const unsigned point_budget = 1 << 20; // per frame, rounded up to whole groups
+GLuint splat_group_size; // read from splat.glsl
+
+array<mat3x4, 4> maps, maps_inverse;
+GLuint maps_buffer, maps_inverse_buffer;
+unsigned selected_map = 0;
+const float map_offset_step = 0.01f;
+float radius;
+
+// One bit per edit key that is held down.
+unsigned held_edit_keys = 0;
+// Time the last edit key was released.
+double last_edit_time = -preview_duration;
+unsigned preview_frame;
+
+// 128 bytes of 4 byte elements, so every scanline starts on a cache line
+const unsigned scanline_alignment = 32;
+GLsizeiptr working_set_alignment = 128;
+
+/*
+Holds the recursion depths, depths and rays of the queue of each pixel
+and the preview depth of each pixel.
+*/
+buffer_arena working_set(GL_STREAM_COPY);
+GLintptr preview_depths_offset;
+GLsizeiptr preview_depths_size;
+
+// Discards all splatted points.
+void clear_preview() {
+    const GLuint empty = ~0u;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, working_set.get_name());
+    glClearBufferSubData(
+        GL_COPY_WRITE_BUFFER, GL_R32UI,
+        preview_depths_offset, preview_depths_size,
+        GL_RED_INTEGER, GL_UNSIGNED_INT, &empty
+    );
+    preview_frame = 0;
+}
+
+void invert_maps() {
+    for (auto i = 0u; i < maps.size(); i++) {
+        mat4 m = mat4(maps[i]);
+        m = inverse(m);
+        maps_inverse[i] = mat3x4(m);
+    }
+}
+
+/*
+Sets radius to a bounding sphere radius around the origin
+that every map maps into itself, r = max |t| / (1 - s),
+where s bounds the scale of the map and t is its translation.
+*/
+void update_radius() {
+    radius = 0;
+    for (auto& map : maps) {
+        // sqrt of the largest column sum times the largest row sum
+        // bounds the spectral norm
+        float row_sum = 0, column_sum = 0;
+        for (auto i = 0u; i < 3; i++) {
+            row_sum = std::max(
+                row_sum, abs(map[i][0]) + abs(map[i][1]) + abs(map[i][2])
+            );
+            column_sum = std::max(
+                column_sum, abs(map[0][i]) + abs(map[1][i]) + abs(map[2][i])
+            );
+        }
+        float scale = sqrt(row_sum * column_sum);
+        // rows of the affine map are stored as columns
+        vec3 translation(map[0][3], map[1][3], map[2][3]);
+        radius = std::max(radius, length(translation) / (1 - scale));
+    }
+
+    glProgramUniform1f(trace_program, inverse_radius_uniform, 1.0f / radius);
+    glProgramUniform1f(
+        trace_program, occlusion_radius_uniform, radius * 0.25f
+    );
+    glProgramUniform1f(
+        preview_program, preview_inverse_radius_uniform, 1.0f / radius
+    );
+}
+
+void key_callback(GLFWwindow*, int key, int, int action, int) {
+    if (key >= GLFW_KEY_1 && key < GLFW_KEY_1 + static_cast<int>(maps.size())) {
+        if (action == GLFW_PRESS) {
+            selected_map = static_cast<unsigned>(key - GLFW_KEY_1);
+        }
+        return;
+    }
+
+    vec3 offset(0);
+    unsigned key_bit;
+    switch (key) {
+    case GLFW_KEY_LEFT: offset.x = -map_offset_step; key_bit = 1; break;
+    case GLFW_KEY_RIGHT: offset.x = map_offset_step; key_bit = 2; break;
+    case GLFW_KEY_DOWN: offset.y = -map_offset_step; key_bit = 4; break;
+    case GLFW_KEY_UP: offset.y = map_offset_step; key_bit = 8; break;
+    case GLFW_KEY_PAGE_DOWN: offset.z = -map_offset_step; key_bit = 16; break;
+    case GLFW_KEY_PAGE_UP: offset.z = map_offset_step; key_bit = 32; break;
+    default: return;
+    }
+
+    if (action == GLFW_RELEASE) {
+        // the preview stays until all edit keys have been released for a while
+        held_edit_keys &= ~key_bit;
+        last_edit_time = glfwGetTime();
+        return;
+    }
+    held_edit_keys |= key_bit;
+
+    // rows of the affine map are stored as columns
+    for (auto i = 0u; i < 3; i++) {
+        maps[selected_map][i][3] += offset[i];
+    }
+    invert_maps();
+    update_radius();
 
-GLuint recursion_depth_buffer, depth_buffer, ray_buffer;
+    buffer_sub_data<mat3x4>(maps_buffer, {maps.begin(), maps.end()});
+    buffer_sub_data<mat3x4>(
+        maps_inverse_buffer, {maps_inverse.begin(), maps_inverse.end()}
+    );
+
+    clear_preview();
+}
+
+void window_size_callback(GLFWwindow* window, int width, int height) {
+    if (width == 0 || height == 0) {
+        // minimized, keep the previous layout
+        return;
+    }
 
-void window_size_callback(GLFWwindow*, int width, int height) {
     window_width = static_cast<unsigned int>(width);
     window_height = static_cast<unsigned int>(height);
     float aspect_ratio = static_cast<float>(window_height) / window_width;
 
     glViewport(0, 0, width, height);
 
-    // TODO: align
-    unsigned scanline_stride = window_width;
+    unsigned scanline_stride = static_cast<unsigned>(
+        align(window_width, scanline_alignment)
+    );
     unsigned image_stride = scanline_stride * window_height;
-    unsigned element_count = image_stride * max_queue_depth;
+    GLsizeiptr element_count =
+        static_cast<GLsizeiptr>(image_stride) * max_queue_depth;
 
-    glUniform2f(view_plane_size_uniform, 1.0f, aspect_ratio);
-    glUniform1ui(scanline_stride_uniform, scanline_stride);
-    glUniform1ui(image_stride_uniform, image_stride);
+    glProgramUniform2f(
+        trace_program, view_plane_size_uniform, 1.0f, aspect_ratio
+    );
+    glProgramUniform1ui(
+        trace_program, scanline_stride_uniform, scanline_stride
+    );
+    glProgramUniform1ui(trace_program, image_stride_uniform, image_stride);
+    glProgramUniform2f(
+        splat_program, splat_view_plane_size_uniform, 1.0f, aspect_ratio
+    );
+    glProgramUniform2ui(
+        splat_program, splat_image_size_uniform, window_width, window_height
+    );
+    glProgramUniform1ui(
+        splat_program, splat_scanline_stride_uniform, scanline_stride
+    );
+    glProgramUniform1ui(
+        preview_program, preview_scanline_stride_uniform, scanline_stride
+    );
 
-    glBindBuffer(GL_COPY_WRITE_BUFFER, recursion_depth_buffer);
-    glBufferData(
-        GL_COPY_WRITE_BUFFER, element_count * sizeof(unsigned),
-        nullptr, GL_STREAM_COPY
+    // the storage is only reallocated if the window grew past its capacity
+    GLsizeiptr recursion_depths_size = element_count * sizeof(unsigned);
+    GLsizeiptr depths_size = element_count * sizeof(float);
+    GLsizeiptr rays_size = element_count * 3 * 4 * sizeof(float);
+
+    working_set.clear();
+    GLintptr recursion_depths_offset =
+        working_set.allocate(recursion_depths_size, working_set_alignment);
+    GLintptr depths_offset =
+        working_set.allocate(depths_size, working_set_alignment);
+    GLintptr rays_offset =
+        working_set.allocate(rays_size, working_set_alignment);
+    preview_depths_size = image_stride * sizeof(unsigned);
+    preview_depths_offset =
+        working_set.allocate(preview_depths_size, working_set_alignment);
+    if (!working_set.reserve()) {
+        // exceptions can't unwind through GLFW
+        cerr << "Out of memory for the working set." << endl;
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+        return;
+    }
+
+    glBindBufferRange(
+        GL_SHADER_STORAGE_BUFFER, 2, working_set.get_name(),
+        recursion_depths_offset, recursion_depths_size
     );
-    glBindBuffer(GL_COPY_WRITE_BUFFER, depth_buffer);
-    glBufferData(
-        GL_COPY_WRITE_BUFFER, element_count * sizeof(float),
-        nullptr, GL_STREAM_COPY
+    glBindBufferRange(
+        GL_SHADER_STORAGE_BUFFER, 3, working_set.get_name(),
+        depths_offset, depths_size
     );
-    glBindBuffer(GL_COPY_WRITE_BUFFER, ray_buffer);
-    glBufferData(
-        GL_COPY_WRITE_BUFFER, element_count * 3 * 4 * sizeof(float),
-        nullptr, GL_STREAM_COPY
+    glBindBufferRange(
+        GL_SHADER_STORAGE_BUFFER, 4, working_set.get_name(),
+        rays_offset, rays_size
+    );
+    glBindBufferRange(
+        GL_SHADER_STORAGE_BUFFER, 5, working_set.get_name(),
+        preview_depths_offset, preview_depths_size
     );
 
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, recursion_depth_buffer);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, depth_buffer);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ray_buffer);
+    clear_preview();
 }
 
 int main()
@@ -83,6 +261,15 @@ int main()
 
     glEnable(GL_FRAMEBUFFER_SRGB);
 
+    {
+        GLint offset_alignment;
+        glGetIntegerv(
+            GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &offset_alignment
+        );
+        working_set_alignment =
+            std::max<GLsizeiptr>(working_set_alignment, offset_alignment);
+    }
+
     enum attributes : GLuint {
         position
     };
@@ -103,7 +290,7 @@ int main()
             0.0, 0.0, 0.5, 0.0
         },
     }};*/
-    array<const mat3x4, 4> maps{{
+    maps = {{
         {
             0.5, 0.0, 0.0, -0.25,
             0.0, 0.5, 0.0, 0.0,
@@ -123,14 +310,9 @@ int main()
         },
     }};
 
-    array<mat3x4, 4> maps_inverse;
-    for (auto i = 0u; i < 4; i++) {
-        mat4 m = mat4(maps[i]);
-        m = inverse(m);
-        maps_inverse[i] = mat3x4(m);
-    }
+    invert_maps();
 
-    auto trace_program = compile_program(
+    trace_program = compile_program(
         "trace_vs.glsl", nullptr, nullptr, nullptr, "trace_fs.glsl", {},
         {{"position", position}}
     );
@@ -140,23 +322,51 @@ int main()
             {"scanline_stride", &scanline_stride_uniform},
             {"image_stride", &image_stride_uniform},
             {"max_depth", &max_depth_uniform},
+            {"max_queue_depth", &max_queue_depth_uniform},
             {"inverse_radius", &inverse_radius_uniform},
+            {"occlusion_radius", &occlusion_radius_uniform},
         }
     );
 
-    auto maps_buffer = create_buffer<const mat3x4>(
-        GL_SHADER_STORAGE_BUFFER, GL_STATIC_DRAW,
+    splat_program = compile_program("splat.glsl");
+    {
+        GLint work_group_size[3];
+        glGetProgramiv(
+            splat_program, GL_COMPUTE_WORK_GROUP_SIZE, work_group_size
+        );
+        splat_group_size = static_cast<GLuint>(work_group_size[0]);
+    }
+    get_uniform_locations(
+        splat_program, {
+            {"view_plane_size", &splat_view_plane_size_uniform},
+            {"image_size", &splat_image_size_uniform},
+            {"scanline_stride", &splat_scanline_stride_uniform},
+            {"seed", &seed_uniform},
+            {"points_per_invocation", &points_per_invocation_uniform},
+        }
+    );
+
+    preview_program = compile_program(
+        "trace_vs.glsl", nullptr, nullptr, nullptr, "preview_fs.glsl", {},
+        {{"position", position}}
+    );
+    get_uniform_locations(
+        preview_program, {
+            {"scanline_stride", &preview_scanline_stride_uniform},
+            {"inverse_radius", &preview_inverse_radius_uniform},
+        }
+    );
+
+    maps_buffer = create_buffer<const mat3x4>(
+        GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW,
         {maps.begin(), maps.end()}
     );
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, maps_buffer);
-    auto maps_inverse_buffer = create_buffer<const mat3x4>(
-        GL_SHADER_STORAGE_BUFFER, GL_STATIC_DRAW,
+    maps_inverse_buffer = create_buffer<const mat3x4>(
+        GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW,
         {maps_inverse.begin(), maps_inverse.end()}
     );
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, maps_inverse_buffer);
-    glGenBuffers(1, &recursion_depth_buffer);
-    glGenBuffers(1, &depth_buffer);
-    glGenBuffers(1, &ray_buffer);
 
     auto quad_buffer = create_buffer<const vec2>(
         GL_ARRAY_BUFFER, GL_STATIC_DRAW, quad_positions
@@ -170,14 +380,19 @@ int main()
         position, 2, GL_FLOAT, GL_FALSE, sizeof(vec2), nullptr
     );
 
-    glUseProgram(trace_program);
     max_depth = 3;
     max_queue_depth = 10;
+    // depth of the stack used for secondary rays
+    assert((maps.size() - 1) * (max_depth - 1) + 1 <= max_queue_depth);
 
-    float radius = 0.5;
-
-    glUniform1ui(max_depth_uniform, max_depth);
-    glUniform1f(inverse_radius_uniform, 1.0f / radius);
+    glProgramUniform1ui(trace_program, max_depth_uniform, max_depth);
+    glProgramUniform1ui(
+        trace_program, max_queue_depth_uniform, max_queue_depth
+    );
+    glProgramUniform1ui(
+        splat_program, points_per_invocation_uniform, points_per_invocation
+    );
+    update_radius();
 
     {
         int width, height;
@@ -186,12 +401,31 @@ int main()
     }
 
     glfwSetWindowSizeCallback(window, &window_size_callback);
+    glfwSetKeyCallback(window, &key_callback);
 
     while (!glfwWindowShouldClose(window)) {
         glClear(GL_COLOR_BUFFER_BIT);
 
         glBindVertexArray(quad_array);
 
+        if (
+            held_edit_keys != 0 ||
+            glfwGetTime() - last_edit_time < preview_duration
+        ) {
+            // points accumulate until the maps change again
+            glUseProgram(splat_program);
+            glProgramUniform1ui(splat_program, seed_uniform, preview_frame++);
+            GLuint points_per_group = splat_group_size * points_per_invocation;
+            glDispatchCompute(
+                (point_budget + points_per_group - 1) / points_per_group, 1, 1
+            );
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            glUseProgram(preview_program);
+        } else {
+            glUseProgram(trace_program);
+        }
+
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
         glfwSwapBuffers(window);
@@ -0,0 +1,32 @@
+#version 460
+
+in vec2 vertex_position;
+
+out vec3 fragment_color;
+
+uniform uint scanline_stride;
+
+uniform float inverse_radius;
+
+layout(std430) buffer;
+
+layout(binding = 5) readonly buffer PreviewDepths {
+    uint preview_depths[];
+};
+
+void main(void)
+{
+    ivec2 screen_position = ivec2(gl_FragCoord.xy);
+    uint depth_bits =
+        preview_depths[screen_position.y * scanline_stride + screen_position.x];
+
+    if (depth_bits == 0xFFFFFFFFu) {
+        fragment_color = vec3(0);
+        return;
+    }
+
+    // the camera is one unit from the center, points are within the radius
+    float depth = uintBitsToFloat(depth_bits);
+    float shade = clamp(((depth - 1) * inverse_radius + 1) * 0.5, 0, 1);
+    fragment_color = vec3(mix(1.0, 0.1, shade));
+}
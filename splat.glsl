@@ -0,0 +1,82 @@
+#version 460
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+
+uniform vec2 view_plane_size;
+uniform uvec2 image_size;
+uniform uint scanline_stride;
+uniform uint seed;
+uniform uint points_per_invocation;
+
+layout(std430) buffer;
+
+layout(row_major, binding = 0) readonly buffer Maps {
+    mat4x3 maps[];
+};
+
+/*
+Closest depth of any point per pixel as the bits of a positive float,
+which compare the same as unsigned integers.
+*/
+layout(binding = 5) buffer PreviewDepths {
+    uint preview_depths[];
+};
+
+/*
+Permuted congruential generator.
+The increment selects the stream and has to be odd.
+Every invocation uses its own increment so the streams are independent.
+*/
+uint random(inout uint state, uint increment) {
+    state = state * 747796405u + increment;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+/*
+Projects the point with the same camera as the tracer
+and keeps it if it's the closest in its pixel.
+*/
+void splat(vec3 point) {
+    vec3 relative = point - vec3(0, 0, -1);
+    if (relative.z <= 0) {
+        return;
+    }
+
+    vec2 position = relative.xy / (relative.z * view_plane_size);
+    if (any(greaterThanEqual(abs(position), vec2(1)))) {
+        return;
+    }
+
+    uvec2 pixel = min(
+        uvec2((position * 0.5 + 0.5) * vec2(image_size)), image_size - 1
+    );
+    atomicMin(
+        preview_depths[pixel.y * scanline_stride + pixel.x],
+        floatBitsToUint(relative.z)
+    );
+}
+
+/*
+Chaos game: applying randomly chosen maps to any point
+converges to the attractor, which is what the tracer renders.
+*/
+void main(void) {
+    uint increment = (gl_GlobalInvocationID.x << 1u) | 1u;
+    uint state = 0;
+    random(state, increment);
+    state += seed * 2654435769u;
+    random(state, increment);
+
+    uint map_count = maps.length();
+    vec3 point = vec3(0);
+
+    // the first iterations may not be on the attractor yet
+    for (uint i = 0; i < 16; i++) {
+        point = maps[random(state, increment) % map_count] * vec4(point, 1);
+    }
+
+    for (uint i = 0; i < points_per_invocation; i++) {
+        point = maps[random(state, increment) % map_count] * vec4(point, 1);
+        splat(point);
+    }
+}
@@ -8,8 +8,15 @@ uniform vec2 view_plane_size;
 uniform uint scanline_stride;
 uniform uint image_stride;
 uniform uint max_depth;
+uniform uint max_queue_depth;
 
 uniform float inverse_radius;
+uniform float occlusion_radius;
+
+const uint occlusion_samples = 2;
+// one shadow segment and the ambient occlusion segments
+const uint secondary_count = 1 + occlusion_samples;
+const float ray_epsilon = 1e-3; // minimum distance of secondary hits
 
 uint index;
 uint size;
@@ -31,6 +38,11 @@ layout(binding = 3) buffer PixelDepths {
 
 struct ray {
     vec3 origin, direction, light;
+    /*
+    Indices of the maps applied to reach this node,
+    one digit in base maps_inverse.length() per recursion level.
+    */
+    uint path;
 };
 
 layout(binding = 4) buffer Rays {
@@ -127,6 +139,33 @@ depth_result depth(
     return d;
 }
 
+/*
+Range of the ray parameter over which the ray is inside the sphere,
+in the scale of the unscaled ray.
+Assumes test has already been used and there is an intersection.
+*/
+struct extent_result {
+    float entry, exit;
+};
+
+extent_result extent(
+    intersection_parameters p, test_result t
+) {
+    extent_result e;
+    // closest is the direction times the parameter of the closest point,
+    // both multiplied by direction_squared
+    float center =
+        dot(t.closest, p.direction) /
+        (p.direction_squared * p.direction_squared);
+    float half_width =
+        sqrt(max(t.depth_offset_squared, 0)) /
+        (p.direction_squared * sqrt(p.direction_squared));
+    // origin is scaled by inverse_radius but direction isn't
+    e.entry = (center - half_width) / inverse_radius;
+    e.exit = (center + half_width) / inverse_radius;
+    return e;
+}
+
 struct intersection_result {
     /*
     Vector from origin to intersection.
@@ -146,8 +185,12 @@ intersection_result intersection (
     return i;
 }
 
+/*
+light_visibility scales the direct light, ambient_visibility the ambient term.
+*/
 float phong_shading(
-    vec3 normal, vec3 position, vec3 direction, vec3 light_position
+    vec3 normal, vec3 position, vec3 direction, vec3 light_position,
+    float light_visibility, float ambient_visibility
 ) {
     vec3 light_direction = normalize(light_position - position);
     vec3 reflection_direction = reflect(light_direction, normal);
@@ -155,7 +198,41 @@ float phong_shading(
     float specular =
         pow(max(dot(normalize(direction), reflection_direction), 0), 100);
     float ambient = 0.05;
-    return diffuse * 0.5 + specular * 0.5 + ambient;
+    return
+        (diffuse * 0.5 + specular * 0.5) * light_visibility +
+        ambient * ambient_visibility;
+}
+
+/*
+Transforms a normal from the space of the node at the end of path
+back to world space.
+*/
+vec3 world_normal(vec3 normal, uint path, uint recursion_depth) {
+    uint map_count = maps_inverse.length();
+    // the last applied map is in the least significant digit
+    for (uint level = 0; level < recursion_depth; level++) {
+        normal = transpose(mat3(maps_inverse[path % map_count])) * normal;
+        path /= map_count;
+    }
+    return normalize(normal);
+}
+
+/*
+Transforms a direction from world space
+into the space of the node at the end of path.
+*/
+vec3 node_direction(vec3 direction, uint path, uint recursion_depth) {
+    uint map_count = maps_inverse.length();
+    // the first applied map is in the most significant digit
+    uint digit = 1;
+    for (uint level = 1; level < recursion_depth; level++) {
+        digit *= map_count;
+    }
+    for (uint level = 0; level < recursion_depth; level++) {
+        direction = mat3(maps_inverse[path / digit % map_count]) * direction;
+        digit /= map_count;
+    }
+    return direction;
 }
 
 uint heap_child(uint parent) {
@@ -189,7 +266,12 @@ struct element {
     float depth;
 };
 
+// Drops the element if the queue is full.
 void heap_insert(element e) {
+    if (size >= max_queue_depth) {
+        return;
+    }
+
     uint last = size * image_stride + index;
     rays[last] = e.r;
     recursion_depths[last] = e.recursion_depth;
@@ -255,6 +337,104 @@ element heap_pop() {
     return e;
 }
 
+/*
+Returns a mask of the segments that any leaf intersects.
+All segments start at origin, segment s is the part of the ray along
+directions[s] between the parameters begins[s] and 1.
+Unlike the primary traversal, nodes don't need to be visited in order
+so the queue is used as a stack. Each node is visited once for all segments
+and carries a mask of the unresolved segments overlapping it,
+the traversal ends once every segment hit a leaf.
+Segments that can't be resolved within the queue or iteration limits
+are counted as occluded.
+*/
+uint occluded(
+    vec3 origin, vec3 directions[secondary_count],
+    float begins[secondary_count]
+) {
+    uint unresolved = (1u << secondary_count) - 1;
+    uint hits = 0;
+
+    // the mask is stored above the recursion depth
+    size = 0;
+    rays[index].origin = origin;
+    rays[index].path = 0;
+    recursion_depths[index] = unresolved << 16;
+    size++;
+
+    uint counter = 0;
+
+    while (size > 0 && unresolved != 0) {
+        if (counter >= 100) {
+            return hits | unresolved;
+        }
+        counter++;
+        size--;
+        uint top = size * image_stride + index;
+        ray e = rays[top];
+        uint recursion_depth = (recursion_depths[top] & 0xFFFFu) + 1;
+        // segments may have been resolved since the node was queued
+        uint mask = (recursion_depths[top] >> 16) & unresolved;
+        if (mask == 0) {
+            continue;
+        }
+
+        vec3 node_directions[secondary_count];
+        for (uint s = 0; s < secondary_count; s++) {
+            if ((mask & (1u << s)) != 0) {
+                node_directions[s] = node_direction(
+                    directions[s], e.path, recursion_depth - 1
+                );
+            }
+        }
+
+        for (uint m = 0; m < maps_inverse.length(); m++) {
+            mat4x3 map = maps_inverse[m];
+            ray child = e;
+            child.origin = map * vec4(e.origin, 1);
+            child.path = e.path * maps_inverse.length() + m;
+
+            uint child_mask = 0;
+            for (uint s = 0; s < secondary_count; s++) {
+                if ((mask & (1u << s)) == 0) {
+                    continue;
+                }
+
+                intersection_parameters p;
+                p.origin = child.origin * inverse_radius;
+                p.direction = map * vec4(node_directions[s], 0);
+                p.direction_squared = dot(p.direction, p.direction);
+
+                test_result t = test(p);
+                if (t.depth_offset_squared >= 0) {
+                    extent_result x = extent(p, t);
+                    if (x.exit >= begins[s] && x.entry <= 1) {
+                        child_mask |= 1u << s;
+                    }
+                }
+            }
+
+            if (child_mask == 0) {
+                continue;
+            }
+
+            if (recursion_depth >= max_depth || size >= max_queue_depth) {
+                // a leaf, or a node that doesn't fit and might contain one
+                hits |= child_mask;
+                unresolved &= ~child_mask;
+                mask &= ~child_mask;
+            } else {
+                uint last = size * image_stride + index;
+                rays[last] = child;
+                recursion_depths[last] = recursion_depth | (child_mask << 16);
+                size++;
+            }
+        }
+    }
+
+    return hits;
+}
+
 void main(void)
 {
     ivec2 screen_position = ivec2(gl_FragCoord.xy);
@@ -286,11 +466,17 @@ void main(void)
     r.origin = vec3(0, 0, -1);
     r.direction = vec3(vertex_position * view_plane_size, 1);
     r.light = light_position;
+    r.path = 0;
     e.r = r;
     e.recursion_depth = 0;
     e.depth = 3; // TODO
     heap_insert(e);
 
+    bool hit = false;
+    element closest;
+    intersection_parameters closest_parameters;
+    intersection_result closest_intersection;
+
     uint counter = 0;
 
     while (size > 0 && counter < 100) {
@@ -304,6 +490,7 @@ void main(void)
             child.r.origin = map * vec4(e.r.origin, 1);
             child.r.direction = map * vec4(e.r.direction, 0);
             child.r.light = map * vec4(e.r.light, 1);
+            child.r.path = e.r.path * maps_inverse.length() + m;
 
             intersection_parameters p;
             p.origin = child.r.origin * inverse_radius;
@@ -319,15 +506,77 @@ void main(void)
                 } else {
                     if (d.depth_squared < depth_squared) {
                         depth_squared = d.depth_squared;
-                        intersection_result i = intersection(p, d);
-                        fragment_color = vec3(
-                            phong_shading(
-                                i.normal, i.position, p.direction, child.r.light
-                            )
-                        );
+                        hit = true;
+                        closest = child;
+                        closest_parameters = p;
+                        closest_intersection = intersection(p, d);
                     }
                 }
             }
         }
     }
+
+    if (!hit) {
+        return;
+    }
+
+    /*
+    Generate all secondary segments from the closest hit first,
+    then trace them together.
+    The first is the shadow segment, ending at the light,
+    the others are ambient occlusion segments, ending at occlusion_radius.
+    Ray parameters are the same in world space and node space.
+    */
+    float hit_parameter =
+        sqrt(depth_squared) / (
+            closest_parameters.direction_squared *
+            sqrt(closest_parameters.direction_squared) * inverse_radius
+        );
+    vec3 hit_position = r.origin + r.direction * hit_parameter;
+    vec3 hit_normal = world_normal(
+        closest_intersection.normal, closest.r.path, closest.recursion_depth
+    );
+
+    vec3 secondary_directions[secondary_count];
+    secondary_directions[0] = light_position - hit_position;
+
+    // orthonormal basis around the normal, rotated per pixel
+    vec3 tangent = normalize(cross(
+        hit_normal,
+        abs(hit_normal.x) < 0.5 ? vec3(1, 0, 0) : vec3(0, 1, 0)
+    ));
+    vec3 bitangent = cross(hit_normal, tangent);
+    float rotation = fract(
+        sin(dot(vec2(screen_position), vec2(12.9898, 78.233))) * 43758.5453
+    );
+    for (uint s = 0; s < occlusion_samples; s++) {
+        // cosine weighted directions on a golden angle spiral
+        float u = (s + 0.5) / occlusion_samples;
+        float angle = 6.2831853 * fract(rotation + s * 0.618034);
+        vec3 direction =
+            sqrt(u) * (cos(angle) * tangent + sin(angle) * bitangent) +
+            sqrt(1 - u) * hit_normal;
+        secondary_directions[1 + s] = direction * occlusion_radius;
+    }
+
+    float secondary_begins[secondary_count];
+    for (uint s = 0; s < secondary_count; s++) {
+        secondary_begins[s] = ray_epsilon / length(secondary_directions[s]);
+    }
+
+    uint hits = occluded(
+        hit_position, secondary_directions, secondary_begins
+    );
+
+    float light_visibility = (hits & 1u) != 0 ? 0 : 1;
+    float ambient_visibility =
+        1 - float(bitCount(hits >> 1)) / occlusion_samples;
+
+    fragment_color = vec3(
+        phong_shading(
+            closest_intersection.normal, closest_intersection.position,
+            closest_parameters.direction, closest.r.light,
+            light_visibility, ambient_visibility
+        )
+    );
 }